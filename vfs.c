@@ -2,34 +2,65 @@
 //                                                                    //
 //            Trabalho II: Sistema de Gestão de Ficheiros             //
 //                                                                    //
-// Compilação: gcc vfs.c -Wall -lreadline -o vfs                      //
-// Utilização: ./vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] FILESYSTEM //
+// Compilação: gcc vfs.c -Wall -pthread -lreadline -o vfs             //
+// Utilização: ./vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] [-qN]      //
+//                   FILESYSTEM                                       //
 //                                                                    //
 ////////////////////////////////////////////////////////////////////////
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MAXARGS 100
 #define CHECK_NUMBER 9999
 #define TYPE_DIR 'D'
 #define TYPE_FILE 'F'
 #define MAX_NAME_LENGHT 20
+#define QUEUE_DEPTH 32            // pedidos de I/O em curso por omissão (get/put)
+#define MAX_QUEUE_DEPTH 4096
+#define XFER_RUN_MAX (128 * 1024) // tamanho máximo de cada pedido de I/O
+#define XFER_READ 0               // ficheiro UNIX -> blocos
+#define XFER_WRITE 1              // blocos -> ficheiro UNIX
+#define MAX_WALK_THREADS 16
+#define MAX_DIR_DEPTH 1024
+#define MAX_SNAPSHOTS 255         // as contagens de referências são unsigned char
+#define SUMMARY_MAGIC 0x53554d4d  // "SUMM"
+#define SUMMARY_VERSION 1
 
 #define FAT_ENTRIES(TYPE) ((TYPE) == 7 ? 128 : (TYPE) == 8 ? 256 : (TYPE) == 9 ? 512 : 1024)
 #define FAT_SIZE(TYPE) (FAT_ENTRIES(TYPE) * sizeof(int))
 #define BLOCK(N) (blocks + (N) * sb->block_size)
 #define DIR_ENTRIES_PER_BLOCK (sb->block_size / sizeof(dir_entry))
 
+// ligações da cadeia de um ficheiro (FAT ou first_block): >= 0 próximo bloco,
+// -1 fim, < -1 buraco de N blocos lógicos sem dados seguido do bloco NEXT (ou -1)
+#define HOLE_BASE (FAT_ENTRIES(sb->fat_type) + 1)
+#define HOLE_MAX ((0x7fffffff - 2) / HOLE_BASE)
+#define HOLE_LINK(N, NEXT) (-2 - ((N) - 1) * HOLE_BASE - ((NEXT) + 1))
+#define IS_HOLE_LINK(L) ((L) < -1)
+#define HOLE_BLOCKS(L) ((-2 - (L)) / HOLE_BASE + 1)
+#define HOLE_NEXT(L) ((-2 - (L)) % HOLE_BASE - 1)
+
 typedef struct command {
   char *cmd;              // string apenas com o comando
   int argc;               // número de argumentos
@@ -43,6 +74,10 @@ typedef struct superblock_entry {
   int root_block;     // número do 1º bloco a que corresponde o diretório raiz
   int free_block;     // número do 1º bloco da lista de blocos não utilizados
   int n_free_blocks;  // total de blocos não utilizados
+  int snap_block;     // 1º bloco do diretório de snapshots (0 se não existe)
+  int ref_block;      // 1º bloco da tabela de referências partilhadas (0 se não existe)
+  int clean;          // 1 se o sistema foi desmontado correctamente
+  int summary_block;  // 1º bloco do resumo escrito na desmontagem (0 se não existe)
 } superblock;
 
 typedef struct directory_entry {
@@ -55,11 +90,79 @@ typedef struct directory_entry {
   int first_block;             // primeiro bloco de dados
 } dir_entry;
 
+typedef struct summary_header {
+  int magic;           // SUMMARY_MAGIC
+  int version;         // SUMMARY_VERSION
+  unsigned checksum;   // FNV-1a do cabeçalho (com checksum a 0) e do que se lhe segue
+  int length;          // bytes que se seguem ao cabeçalho
+  int n_free_blocks;   // cópia de sb->n_free_blocks no momento da escrita
+  int high_water;      // 1 + maior bloco em uso
+  int n_extents;       // número de pares (início, comprimento) de blocos livres que se seguem
+} summary_header;
+
+typedef struct xfer_run {
+  char *buf;  // início da sequência de blocos contíguos na região dos dados
+  off_t off;  // posição correspondente no ficheiro UNIX
+  int len;    // bytes ainda por transferir
+} xfer_run;
+
+typedef struct walk_task {
+  int block;   // primeiro bloco do diretório a percorrer
+  char *path;  // caminho do diretório relativo ao diretório corrente
+} walk_task;
+
+typedef struct walk_queue {
+  pthread_mutex_t lock;
+  walk_task *tasks;  // o dono tira do fim, os outros roubam do início
+  int head, tail, cap;
+} walk_queue;
+
+typedef struct walk_ctx {
+  int n_workers;
+  walk_queue *queues;
+  int pending;  // tarefas ainda não terminadas (em fila ou em curso)
+  void (*visit)(struct walk_ctx *, dir_entry *, char *);
+  // predicados do find (type == 0, size_cmp == 0 ou date_cmp == 0 --> ignorado)
+  char *name;
+  char type;
+  int size_cmp, size;
+  int date_cmp, date;
+  // padrão do grep
+  char *pattern;
+  int pattern_len;
+  // caminhos encontrados
+  pthread_mutex_t lock;
+  char **results;
+  int n_results, results_cap;
+} walk_ctx;
+
+typedef struct walk_worker {
+  walk_ctx *ctx;
+  int id;
+} walk_worker;
+
+typedef struct io_ring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+} io_ring;
+
 // variáveis globais
 superblock *sb;   // superblock do sistema de ficheiros
 int *fat;         // apontador para a FAT
 char *blocks;     // apontador para a região dos dados
 int current_dir;  // bloco do diretório corrente
+int dir_path[MAX_DIR_DEPTH];  // diretórios desde a raiz até ao corrente
+int dir_depth;                // índice do diretório corrente em dir_path
+char *mounted_snapshot;       // snapshot montado (só de leitura) ou NULL
+int fs_size;                  // tamanho do mapeamento do sistema de ficheiros
+int summary_stale;            // o resumo em disco já não corresponde ao estado actual
+int queue_depth;  // número máximo de pedidos de I/O em curso nas transferências
 
 // funções auxiliares
 COMMAND parse(char *);
@@ -70,15 +173,33 @@ void init_superblock(int, int);
 void init_fat(void);
 void init_dir_block(int, int);
 void init_dir_entry(dir_entry *, char, char *, int, int);
+void unmount_filesystem(void);
+void rebuild_filesystem(void);
+void rebuild_walk(dir_entry *, unsigned char *, int *);
+void rebuild_dir(int, unsigned char *, int *);
+void mark_chain(int *, unsigned char *);
+void release_summary(void);
+int free_extents(int *);
+int write_summary(void);
+summary_header *load_summary(void);
+unsigned checksum(char *, int);
 void exec_com(COMMAND);
 int cmp_dir(const void * a, const void * b);
+int xfer_blocks(int, int, off_t, int);
+int xfer_build_runs(int, off_t, xfer_run *);
+int xfer_sync(int, xfer_run *, int, int);
+int ring_init(io_ring *, unsigned);
+void ring_exit(io_ring *);
+int host_data_map(int, off_t, int *, int);
+int link_chain(int *, int);
+int block_is_zero(char *, int);
+int prepare_write(void);
 
 // funções de manipulação de diretórios
 void vfs_ls(void);
 void vfs_mkdir(char *);
 void vfs_cd(char *);
 void vfs_pwd(void);
-void vfs_pwdcdir(int);
 void vfs_rmdir(char *);
 
 // funções de manipulação de ficheiros
@@ -88,6 +209,35 @@ void vfs_cat(char *);
 void vfs_cp(char *, char *);
 void vfs_mv(char *, char *);
 void vfs_rm(char *);
+void vfs_df(void);
+
+// funções de pesquisa
+void vfs_find(int, char **);
+void vfs_grep(char *);
+void walk_tree(walk_ctx *);
+void *walk_thread(void *);
+void walk_push(walk_ctx *, int, walk_task);
+int walk_pop(walk_ctx *, int, walk_task *);
+void walk_report(walk_ctx *, char *);
+void find_visit(walk_ctx *, dir_entry *, char *);
+void grep_visit(walk_ctx *, dir_entry *, char *);
+int search_block(char *, int, char *, int);
+int cmp_path(const void *, const void *);
+
+// funções de snapshots
+void vfs_snapshot(char *);
+void vfs_snapshot_delete(char *);
+void vfs_snapshot_list(void);
+void vfs_mount(char *);
+void vfs_umount(void);
+dir_entry *snapshot_find(char *);
+dir_entry *dir_find(int, char *);
+unsigned char *block_ref(int);
+int chain_head(int);
+int dir_copy(int, int);
+void tree_release(int, char, int *, int *, int *);
+dir_entry *dir_append(int);
+void dir_remove(int, dir_entry *);
 
 
 int main(int argc, char *argv[]) {
@@ -127,7 +277,8 @@ void parse_argv(int argc, char *argv[]) {
   // valores por omissão
   block_size = 256;
   fat_type = 8;
-  if (argc < 2 || argc > 4) {
+  queue_depth = QUEUE_DEPTH;
+  if (argc < 2 || argc > 5) {
     printf("vfs: invalid number of arguments\n");
     show_usage_and_exit();
   }
@@ -145,6 +296,12 @@ void parse_argv(int argc, char *argv[]) {
 	  printf("vfs: invalid fat type (%d)\n", fat_type);
 	  show_usage_and_exit();
 	}
+      } else if (argv[i][1] == 'q') {
+	queue_depth = atoi(&argv[i][2]);
+	if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+	  printf("vfs: invalid queue depth (%d)\n", queue_depth);
+	  show_usage_and_exit();
+	}
       } else {
 	printf("vfs: invalid argument (%s)\n", argv[i]);
 	show_usage_and_exit();
@@ -160,7 +317,7 @@ void parse_argv(int argc, char *argv[]) {
 
 
 void show_usage_and_exit(void) {
-  printf("Usage: vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] FILESYSTEM\n");
+  printf("Usage: vfs [-b[128|256|512|1024]] [-f[7|8|9|10]] [-qN] FILESYSTEM\n");
   exit(1);
 }
 
@@ -222,11 +379,33 @@ void init_filesystem(int block_size, int fat_type, char *filesystem_name) {
       printf("vfs: invalid filesystem (%s)\n", filesystem_name);
       show_usage_and_exit();
     }
+
+    // só depois de uma desmontagem incorrecta é preciso percorrer o sistema todo;
+    // caso contrário o resumo é lido quando for preciso
+    if (!sb->clean) {
+      printf("vfs: filesystem was not cleanly unmounted, rebuilding free list\n");
+      rebuild_filesystem();
+    } else if (sb->summary_block != 0) {
+      char *summary = BLOCK(sb->summary_block);
+      char *page = (char *) ((unsigned long int) summary & ~(sysconf(_SC_PAGESIZE) - 1));
+      madvise(page, summary + sb->block_size - page, MADV_WILLNEED);
+    }
   }
   close(fsd);
+  fs_size = filesystem_size;
+
+  // os metadados (superblock e FAT) são lidos por quase todos os comandos
+  madvise(sb, (char *) blocks - (char *) sb, MADV_WILLNEED);
+
+  // marca o sistema como montado até à desmontagem em unmount_filesystem
+  sb->clean = 0;
+  msync(sb, sb->block_size, MS_SYNC);
+  atexit(unmount_filesystem);
 
   // inicia o diretório corrente
   current_dir = sb->root_block;
+  dir_path[0] = current_dir;
+  dir_depth = 0;
   return;
 }
 
@@ -238,6 +417,10 @@ void init_superblock(int block_size, int fat_type) {
   sb->root_block = 0;
   sb->free_block = 1;
   sb->n_free_blocks = FAT_ENTRIES(fat_type) - 1;
+  sb->snap_block = 0;
+  sb->ref_block = 0;
+  sb->clean = 0;
+  sb->summary_block = 0;
   return;
 }
 
@@ -277,6 +460,317 @@ void init_dir_entry(dir_entry *dir, char type, char *name, int size, int first_b
 }
 
 
+
+// desmontagem: escreve o resumo (se mudou) e só depois marca o sistema como limpo
+void unmount_filesystem(void) {
+  summary_header *h = load_summary();
+
+  // reescreve também um resumo danificado
+  if (h == NULL)
+    write_summary();
+  free(h);
+  msync(sb, fs_size, MS_SYNC);
+  sb->clean = 1;
+  msync(sb, sb->block_size, MS_SYNC);
+  munmap(sb, fs_size);
+  return;
+}
+
+
+// reconstrói a lista de blocos livres e as contagens de referências a partir das
+// árvores (activa e snapshots); o resumo antigo não é de confiança e é descartado.
+// Os metadados podem estar danificados: as ligações fora de [0, FAT_ENTRIES) ou para
+// blocos já usados cortam a cadeia nesse ponto
+void rebuild_filesystem(void) {
+  int n = FAT_ENTRIES(sb->fat_type);
+  int ref_blocks = (n + sb->block_size - 1) / sb->block_size;
+  unsigned char *used = calloc(n, 1);
+  int *refs = calloc(n, sizeof(int));
+  int free_head = -1, n_free = 0;
+
+  // a tabela de referências tem de estar inteira; senão é criada de novo mais abaixo
+  if (sb->ref_block != 0) {
+    int cblock = sb->ref_block, i;
+    for (i = 0; i < ref_blocks && cblock >= 0 && cblock < n && !used[cblock]; i++) {
+      used[cblock] = 1;
+      cblock = i == ref_blocks - 1 ? cblock : fat[cblock];
+    }
+    if (i < ref_blocks) {
+      memset(used, 0, n);
+      sb->ref_block = 0;
+    } else
+      fat[cblock] = -1;
+  }
+  if (sb->snap_block < 0 || sb->snap_block >= n || used[sb->snap_block])
+    sb->snap_block = 0;
+  if (sb->snap_block != 0) {
+    mark_chain(&sb->snap_block, used);
+    rebuild_dir(sb->snap_block, used, refs);
+  }
+
+  // a raiz é sempre um diretório no bloco 0
+  if (sb->root_block < 0 || sb->root_block >= n)
+    sb->root_block = 0;
+  dir_entry *root = (dir_entry *) BLOCK(sb->root_block);
+  root[0].type = TYPE_DIR;
+  root[0].first_block = sb->root_block;
+  rebuild_walk(&root[0], used, refs);
+
+  if (sb->snap_block != 0 && sb->ref_block == 0) {
+    int prev = -1, i = 0;
+    for (int b = 0; b < n && i < ref_blocks; b++) {
+      if (used[b])
+	continue;
+      used[b] = 1;
+      memset(BLOCK(b), 0, sb->block_size);
+      fat[b] = -1;
+      if (prev == -1)
+	sb->ref_block = b;
+      else
+	fat[prev] = b;
+      prev = b;
+      i++;
+    }
+    if (i < ref_blocks) {
+      // sem espaço para a tabela os snapshots não podem ser mantidos
+      for (int b = sb->ref_block; prev != -1 && b != -1; b = fat[b])
+	used[b] = 0;
+      sb->ref_block = 0;
+      sb->snap_block = 0;
+    }
+  }
+  if (sb->ref_block != 0)
+    for (int b = 0; b < n; b++)
+      *block_ref(b) = refs[b] > 1 ? refs[b] - 1 : 0;
+  sb->summary_block = 0;
+
+  // lista por ordem crescente, para que os blocos reservados a seguir sejam contíguos
+  for (int b = n - 1; b >= 0; b--) {
+    if (used[b])
+      continue;
+    fat[b] = free_head;
+    free_head = b;
+    n_free++;
+  }
+  sb->free_block = free_head;
+  sb->n_free_blocks = n_free;
+  summary_stale = 1;
+  free(used);
+  free(refs);
+  return;
+}
+
+
+// conta uma referência para a cadeia da entrada e, na 1ª vez, marca os seus blocos
+// e as cadeias que ela referencia; uma entrada que aponta para fora do sistema ou
+// para o meio de outra cadeia passa a ser um ficheiro vazio
+void rebuild_walk(dir_entry *entry, unsigned char *used, int *refs) {
+  int head = chain_head(entry->first_block);
+
+  if (head == -1)
+    return;
+  if (head < -1 || head >= FAT_ENTRIES(sb->fat_type) || (refs[head] == 0 && used[head])) {
+    entry->type = TYPE_FILE;
+    entry->size = 0;
+    entry->first_block = -1;
+    return;
+  }
+  if (++refs[head] > 1)
+    return;
+  mark_chain(&entry->first_block, used);
+  if (entry->type == TYPE_DIR)
+    rebuild_dir(head, used, refs);
+  return;
+}
+
+
+// percorre as entradas de um diretório cuja cadeia já foi validada por mark_chain
+void rebuild_dir(int cblock, unsigned char *used, int *refs) {
+  dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+  int n_entries = cur_dir[0].size;
+  while (cblock != -1) {
+    int ents = DIR_ENTRIES_PER_BLOCK;
+    if (n_entries < DIR_ENTRIES_PER_BLOCK)
+      ents = n_entries;
+    n_entries -= DIR_ENTRIES_PER_BLOCK;
+    for (int i = 0; i < ents; i++)
+      if (strcmp(cur_dir[i].name, ".") && strcmp(cur_dir[i].name, ".."))
+	rebuild_walk(&cur_dir[i], used, refs);
+    cblock = fat[cblock];
+    cur_dir = (dir_entry *) BLOCK(cblock);
+  }
+  return;
+}
+
+
+// marca os blocos da cadeia que começa em *link; uma ligação para fora do sistema,
+// para um bloco já usado ou para além de FAT_ENTRIES blocos termina ali a cadeia
+void mark_chain(int *link, unsigned char *used) {
+  int n = FAT_ENTRIES(sb->fat_type);
+
+  for (int steps = 0; *link != -1; steps++) {
+    int cblock = chain_head(*link);
+    if (cblock == -1)
+      break;  // buraco no fim do ficheiro
+    if (cblock < -1 || cblock >= n || used[cblock] || steps >= n) {
+      *link = -1;
+      break;
+    }
+    used[cblock] = 1;
+    link = &fat[cblock];
+  }
+  return;
+}
+
+
+// devolve os blocos do resumo à lista de livres; chamado na 1ª alteração depois da
+// montagem, para que o resumo não ocupe espaço durante a sessão
+void release_summary(void) {
+  int cblock = sb->summary_block, n = FAT_ENTRIES(sb->fat_type);
+
+  summary_stale = 1;
+  if (cblock == 0)
+    return;  // 0 é a raiz: não há resumo
+  for (int i = 0; cblock >= 0 && cblock < n && i < n; i++) {
+    int next = fat[cblock];
+    fat[cblock] = sb->free_block;
+    sb->free_block = cblock;
+    sb->n_free_blocks++;
+    cblock = next;
+  }
+  sb->summary_block = 0;
+  return;
+}
+
+
+// devolve o número de sequências de blocos livres e, se extents não for NULL,
+// preenche-o com os pares (início, comprimento) por ordem crescente
+int free_extents(int *extents) {
+  int n = FAT_ENTRIES(sb->fat_type), n_extents = 0;
+  unsigned char *is_free = calloc(n, 1);
+
+  for (int b = sb->free_block, i = 0; b != -1 && i < sb->n_free_blocks; b = fat[b], i++)
+    is_free[b] = 1;
+  for (int b = 0; b < n; b++) {
+    if (!is_free[b] || (b > 0 && is_free[b-1]))
+      continue;
+    int len = 1;
+    while (b + len < n && is_free[b+len])
+      len++;
+    if (extents != NULL) {
+      extents[2*n_extents] = b;
+      extents[2*n_extents+1] = len;
+    }
+    n_extents++;
+  }
+  free(is_free);
+  return n_extents;
+}
+
+
+// escreve o resumo numa cadeia de blocos nova (os blocos do resumo anterior são
+// libertados antes); devolve -1 se não houver espaço
+int write_summary(void) {
+  int n_blocks = 1;
+
+  if (sb->summary_block != 0)
+    release_summary();
+  while (1) {
+    if (n_blocks > sb->n_free_blocks)
+      return -1;
+    // reserva primeiro, para que o resumo já conte com os seus próprios blocos
+    int first = sb->free_block, cblock = first;
+    for (int i = 0; i < n_blocks; i++) {
+      sb->n_free_blocks--;
+      sb->free_block = fat[cblock];
+      if (i == n_blocks - 1)
+	fat[cblock] = -1;
+      else
+	cblock = fat[cblock];
+    }
+    int n_extents = free_extents(NULL);
+    int length = 2 * n_extents * sizeof(int);
+    int needed = (sizeof(summary_header) + length + sb->block_size - 1) / sb->block_size;
+    if (needed <= n_blocks) {
+      char *buf = calloc(1, n_blocks * sb->block_size);
+      summary_header *h = (summary_header *) buf;
+      h->magic = SUMMARY_MAGIC;
+      h->version = SUMMARY_VERSION;
+      h->length = length;
+      h->n_free_blocks = sb->n_free_blocks;
+      h->n_extents = free_extents((int *) (h + 1));
+      h->high_water = FAT_ENTRIES(sb->fat_type);
+      if (h->n_extents > 0) {
+	int *last = (int *) (h + 1) + 2 * (h->n_extents - 1);
+	if (last[0] + last[1] == FAT_ENTRIES(sb->fat_type))
+	  h->high_water = last[0];
+      }
+      h->checksum = 0;
+      h->checksum = checksum(buf, sizeof(summary_header) + length);
+      cblock = first;
+      for (int i = 0; i < n_blocks; i++, cblock = fat[cblock])
+	memcpy(BLOCK(cblock), buf + i * sb->block_size, sb->block_size);
+      free(buf);
+      sb->summary_block = first;
+      summary_stale = 0;
+      return 0;
+    }
+    // não coube: devolve os blocos e tenta com mais
+    for (cblock = first; cblock != -1; ) {
+      int next = fat[cblock];
+      fat[cblock] = sb->free_block;
+      sb->free_block = cblock;
+      sb->n_free_blocks++;
+      cblock = next;
+    }
+    n_blocks = needed;
+  }
+}
+
+
+// lê o resumo para memória (o chamador liberta-o); NULL se não existe, se a versão
+// ou o checksum não batem certo, ou se o sistema mudou desde a montagem
+summary_header *load_summary(void) {
+  int n = FAT_ENTRIES(sb->fat_type);
+
+  if (sb->summary_block <= 0 || sb->summary_block >= n || summary_stale)
+    return NULL;
+  summary_header *first = (summary_header *) BLOCK(sb->summary_block);
+  if (first->magic != SUMMARY_MAGIC || first->version != SUMMARY_VERSION
+      || first->n_free_blocks != sb->n_free_blocks
+      || first->n_extents < 0 || first->n_extents > n
+      || first->length != first->n_extents * 2 * (int) sizeof(int)
+      || first->high_water < 0 || first->high_water > n)
+    return NULL;
+  int size = sizeof(summary_header) + first->length;
+  char *buf = malloc(size), *p = buf;
+  for (int cblock = sb->summary_block; cblock >= 0 && cblock < n && p < buf + size; cblock = fat[cblock]) {
+    int len = buf + size - p < sb->block_size ? buf + size - p : sb->block_size;
+    memcpy(p, BLOCK(cblock), len);
+    p += len;
+  }
+  summary_header *h = (summary_header *) buf;
+  unsigned stored = h->checksum;
+  h->checksum = 0;
+  if (p < buf + size || checksum(buf, size) != stored) {
+    free(buf);
+    return NULL;
+  }
+  h->checksum = stored;
+  return h;
+}
+
+
+// FNV-1a de 32 bits
+unsigned checksum(char *buf, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char) buf[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
 void exec_com(COMMAND com) {
   // para cada comando invocar a função que o implementa
   if (!strcmp(com.cmd, "exit")) {
@@ -354,6 +848,46 @@ void exec_com(COMMAND com) {
       printf("ERROR(input: 'rm' - too many arguments)\n");
     else
       vfs_rm(com.argv[1]);
+  } else if (!strcmp(com.cmd, "find")) {
+    if (com.argc % 2 == 0)
+      printf("ERROR(input: 'find' - missing predicate value)\n");
+    else
+      vfs_find(com.argc - 1, &com.argv[1]);
+  } else if (!strcmp(com.cmd, "grep")) {
+    if (com.argc < 2)
+      printf("ERROR(input: 'grep' - too few arguments)\n");
+    else if (com.argc > 2)
+      printf("ERROR(input: 'grep' - too many arguments)\n");
+    else
+      vfs_grep(com.argv[1]);
+  } else if (!strcmp(com.cmd, "snapshot")) {
+    if (com.argc == 1)
+      vfs_snapshot_list();
+    else if (com.argc == 2 && !strcmp(com.argv[1], "-d"))
+      printf("ERROR(input: 'snapshot -d' - too few arguments)\n");
+    else if (com.argc == 2)
+      vfs_snapshot(com.argv[1]);
+    else if (com.argc == 3 && !strcmp(com.argv[1], "-d"))
+      vfs_snapshot_delete(com.argv[2]);
+    else
+      printf("ERROR(input: 'snapshot' - invalid arguments)\n");
+  } else if (!strcmp(com.cmd, "df")) {
+    if (com.argc != 1)
+      printf("ERROR(input: 'df' - too many arguments)\n");
+    else
+      vfs_df();
+  } else if (!strcmp(com.cmd, "mount")) {
+    if (com.argc < 2)
+      printf("ERROR(input: 'mount' - too few arguments)\n");
+    else if (com.argc > 2)
+      printf("ERROR(input: 'mount' - too many arguments)\n");
+    else
+      vfs_mount(com.argv[1]);
+  } else if (!strcmp(com.cmd, "umount")) {
+    if (com.argc != 1)
+      printf("ERROR(input: 'umount' - too many arguments)\n");
+    else
+      vfs_umount();
   } else
     printf("ERROR(input: command not found)\n");
   return;
@@ -365,22 +899,28 @@ void vfs_ls(void) {
   int cblock = current_dir;
   dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
   int n_entries = cur_dir[0].size;
+  // ordena uma cópia: o diretório pode ser partilhado com um snapshot
+  dir_entry *sorted = malloc(n_entries * sizeof(dir_entry));
+  int n = 0;
   while (cblock!=-1){
     int ents = DIR_ENTRIES_PER_BLOCK;
     if(n_entries < DIR_ENTRIES_PER_BLOCK)
       ents = n_entries;
     n_entries -= DIR_ENTRIES_PER_BLOCK;
-    qsort(cur_dir,ents,sizeof(dir_entry),cmp_dir);
-    for (int i=0;i<ents;i++){
-      printf("%s \t%d-%d-%d",cur_dir[i].name,cur_dir[i].day,cur_dir[i].month,cur_dir[i].year+1900);
-      if (cur_dir[i].type == TYPE_DIR)
-	printf(" [DIR] \n");
-      else
-	printf(" %d\n",cur_dir[i].size);
-    }
+    memcpy(sorted + n, cur_dir, ents * sizeof(dir_entry));
+    n += ents;
     cblock=fat[cblock];
     cur_dir = (dir_entry *) BLOCK(cblock);
   }
+  qsort(sorted,n,sizeof(dir_entry),cmp_dir);
+  for (int i=0;i<n;i++){
+    printf("%s \t%d-%d-%d",sorted[i].name,sorted[i].day,sorted[i].month,sorted[i].year+1900);
+    if (sorted[i].type == TYPE_DIR)
+      printf(" [DIR] \n");
+    else
+      printf(" %d\n",sorted[i].size);
+  }
+  free(sorted);
   return;
 }
 
@@ -400,6 +940,18 @@ void vfs_mkdir(char *nome_dir) {
     printf("name size exceeds limit\n");
     return;	 
   }
+  if (dir_find(current_dir, nome_dir) != NULL){
+    printf("directory with same name exists\n");
+    return;
+  }
+  // só depois de validar: prepare_write copia os diretórios partilhados
+  if (!prepare_write())
+    return;
+  // o novo diretório e, se o último bloco estiver cheio, mais um bloco de entradas
+  if (sb->n_free_blocks < 1 + (((dir_entry *) BLOCK(current_dir))[0].size % DIR_ENTRIES_PER_BLOCK == 0)){
+    printf("filesystem full\n");
+    return;
+  }
   int cblock = current_dir;
   dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
   dir_entry *cur_dir1 = (dir_entry *) BLOCK(cblock);
@@ -458,6 +1010,15 @@ void vfs_mkdir(char *nome_dir) {
 
 // cd dir - move o diretório actual para dir
 void vfs_cd(char *nome_dir) {
+  // o '..' guardado pode apontar para a cópia de um snapshot, por isso sobe-se por dir_path
+  if (strcmp(nome_dir,"..")==0){
+    if (dir_depth > 0)
+      dir_depth--;
+    current_dir = dir_path[dir_depth];
+    return;
+  }
+  if (strcmp(nome_dir,".")==0)
+    return;
   int cblock = current_dir;
   dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
   int n_entries = cur_dir[0].size;
@@ -468,8 +1029,9 @@ void vfs_cd(char *nome_dir) {
     n_entries -= DIR_ENTRIES_PER_BLOCK;
     
     for (int i=0;i<ents;i++){
-      if (strcmp(nome_dir,cur_dir[i].name)==0){
+      if (strcmp(nome_dir,cur_dir[i].name)==0 && cur_dir[i].type==TYPE_DIR && dir_depth+1 < MAX_DIR_DEPTH){
 	current_dir = cur_dir[i].first_block;
+	dir_path[++dir_depth] = current_dir;
 	return;
       }
     }
@@ -487,57 +1049,58 @@ void vfs_cd(char *nome_dir) {
 
 // pwd - escreve o caminho absoluto do diretório actual
 void vfs_pwd(void) {
-  vfs_pwdcdir(current_dir);
-  printf("\n");
-  return;
-}
-void vfs_pwdcdir(int child) {
-  dir_entry *cur_dir = (dir_entry *) BLOCK(current_dir);
-  if (cur_dir[0].first_block==0){
+  if (mounted_snapshot != NULL)
+    printf("/Root@%s", mounted_snapshot);
+  else
     printf("/Root");
-    return;
-  }
-  int hold = current_dir;
-  vfs_cd("..");
-  vfs_pwdcdir(current_dir);
-  int cblock = current_dir;
-  cur_dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = cur_dir[0].size;
-  while (cblock !=-1){
-    int ents = DIR_ENTRIES_PER_BLOCK;
-    if(n_entries < DIR_ENTRIES_PER_BLOCK)
-      ents = n_entries;
-    n_entries -= DIR_ENTRIES_PER_BLOCK;
-    
-    for (int i=0;i<ents;i++){
-      if (cur_dir[i].first_block==hold){
-	printf("/%s",cur_dir[i].name);
-	vfs_cd(cur_dir[i].name);
-	return;
+  for (int d=1;d<=dir_depth;d++){
+    int cblock = dir_path[d-1];
+    dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+    int n_entries = cur_dir[0].size;
+    int found = 0;
+    while (cblock !=-1 && !found){
+      int ents = DIR_ENTRIES_PER_BLOCK;
+      if(n_entries < DIR_ENTRIES_PER_BLOCK)
+	ents = n_entries;
+      n_entries -= DIR_ENTRIES_PER_BLOCK;
+      for (int i=0;i<ents && !found;i++){
+	if (cur_dir[i].first_block==dir_path[d] && strcmp(cur_dir[i].name,".") && strcmp(cur_dir[i].name,"..")){
+	  printf("/%s",cur_dir[i].name);
+	  found = 1;
+	}
       }
-    }
-    if(fat[cblock] != -1) {
       cblock=fat[cblock];
       cur_dir = (dir_entry *) BLOCK(cblock);
     }
-    else
-      break;
   }
-  current_dir = hold;
+  printf("\n");
+  return;
 }
 
 
 // rmdir dir - remove o subdiretório dir (se vazio) do diretório actual
 void vfs_rmdir(char *nome_dir) {
+  if (strcmp(nome_dir,"..")==0 || strcmp(nome_dir,".")==0){
+    printf("directiries '.' and '..' cannot be removed\n");
+    return;
+  }
+  dir_entry *target = dir_find(current_dir, nome_dir);
+  if (target == NULL || target->type != TYPE_DIR){
+    printf("No such directory\n");
+    return;
+  }
+  if (((dir_entry *) BLOCK(target->first_block))[0].size>2){
+    printf("target directory is not empty, to remove it empty it\n");
+    return;
+  }
+  // só depois de validar: prepare_write copia os diretórios partilhados
+  if (!prepare_write())
+    return;
   int cblock = current_dir;
   dir_entry *cur_dir1 = (dir_entry *) BLOCK(current_dir);
   dir_entry *cur_dir = cur_dir1;
   int n_entries = cur_dir[0].size;
   int prev = cblock;
-  if (strcmp(nome_dir,"..")==0 || strcmp(nome_dir,".")==0){
-    printf("directiries '.' and '..' cannot be removed\n");
-    return;
-  }
   while (cblock !=-1){
     int ents = DIR_ENTRIES_PER_BLOCK;
     if(n_entries < DIR_ENTRIES_PER_BLOCK)
@@ -545,7 +1108,8 @@ void vfs_rmdir(char *nome_dir) {
     n_entries -= DIR_ENTRIES_PER_BLOCK;
     
     for (int i=0;i<ents;i++){
-      if (strcmp(cur_dir[i].name,nome_dir)==0){
+      // só diretórios: o first_block de um ficheiro pode ser -1 ou um buraco
+      if (strcmp(cur_dir[i].name,nome_dir)==0 && cur_dir[i].type==TYPE_DIR){
 	//removes
 	dir_entry *dir = (dir_entry *) BLOCK(cur_dir[i].first_block);
 	if (dir[0].size>2){
@@ -566,9 +1130,13 @@ void vfs_rmdir(char *nome_dir) {
 	  sb->n_free_blocks++;
 	  sb->free_block=lastblock;
 	}
-	fat[cur_dir[i].first_block]=sb->free_block;
-	sb->free_block=cur_dir[i].first_block;
-	sb->n_free_blocks++;
+	if (sb->ref_block != 0 && *block_ref(cur_dir[i].first_block) > 0)
+	  (*block_ref(cur_dir[i].first_block))--;  // ainda pertence a um snapshot
+	else {
+	  fat[cur_dir[i].first_block]=sb->free_block;
+	  sb->free_block=cur_dir[i].first_block;
+	  sb->n_free_blocks++;
+	}
 
 	
 	printf("%d\n",j);
@@ -592,24 +1160,310 @@ void vfs_rmdir(char *nome_dir) {
 }
 
 
+// transferências entre ficheiros UNIX e cadeias de blocos (get/put)
+//
+// A cadeia é percorrida na FAT e os blocos com números consecutivos são
+// agrupados em pedidos de até XFER_RUN_MAX bytes, que são depois submetidos
+// via io_uring mantendo até queue_depth pedidos em curso. Se o io_uring não
+// estiver disponível usa-se pread/pwrite sobre os mesmos pedidos.
+int xfer_blocks(int fd, int first_block, off_t size, int op) {
+  io_ring ring;
+  xfer_run *runs;
+  int n_runs, next = 0, in_flight = 0, done = 0, to_submit = 0, ret = 0;
+
+  if (size <= 0)
+    return 0;
+  if ((runs = malloc(FAT_ENTRIES(sb->fat_type) * sizeof(xfer_run))) == NULL)
+    return -1;
+  n_runs = xfer_build_runs(first_block, size, runs);
+  // o kernel arredonda ring.entries a uma potência de 2: o limite é depth
+  int depth = queue_depth < n_runs ? queue_depth : n_runs;
+  if (ring_init(&ring, depth) == -1) {
+    ret = xfer_sync(fd, runs, n_runs, op);
+    free(runs);
+    return ret;
+  }
+
+  while (done < n_runs) {
+    // enche a fila de submissão
+    while (in_flight < depth && next < n_runs) {
+      unsigned tail = *ring.sq_tail;
+      unsigned idx = tail & *ring.sq_mask;
+      struct io_uring_sqe *sqe = &ring.sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = op == XFER_READ ? IORING_OP_READ : IORING_OP_WRITE;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long) runs[next].buf;
+      sqe->len = runs[next].len;
+      sqe->off = runs[next].off;
+      sqe->user_data = next;
+      ring.sq_array[idx] = idx;
+      __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+      next++;
+      in_flight++;
+      to_submit++;
+    }
+    // submete e só espera se houver pedidos já entregues ao kernel; os que não
+    // foram aceites ficam na fila de submissão para a próxima volta
+    int submitted = to_submit == 0 ? 0 : syscall(__NR_io_uring_enter, ring.fd, to_submit, 0, 0, NULL, 0);
+    if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      ret = -1;
+      break;
+    }
+    if (submitted > 0)
+      to_submit -= submitted;
+    if (in_flight == to_submit) {
+      if (submitted < 0)
+	continue;
+      ret = -1;  // o kernel não aceitou nenhum pedido e não há nenhum em curso
+      break;
+    }
+    if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+	&& errno != EINTR) {
+      ret = -1;
+      break;
+    }
+
+    // recolhe os pedidos terminados
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      xfer_run *run = &runs[cqe->user_data];
+      int res = cqe->res;
+      head++;
+      in_flight--;
+      if (res < 0) {
+	// p.ex. IORING_OP_READ/WRITE não suportados pelo kernel
+	if (xfer_sync(fd, run, 1, op) == -1)
+	  ret = -1;
+	done++;
+      } else if (res == 0 || res == run->len) {
+	// res == 0: o ficheiro UNIX terminou antes do esperado
+	done++;
+      } else {
+	// transferência parcial: volta a submeter o resto
+	run->buf += res;
+	run->off += res;
+	run->len -= res;
+	unsigned tail = *ring.sq_tail;
+	unsigned idx = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op == XFER_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) run->buf;
+	sqe->len = run->len;
+	sqe->off = run->off;
+	sqe->user_data = cqe->user_data;
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	in_flight++;
+	to_submit++;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  ring_exit(&ring);
+  free(runs);
+  return ret;
+}
+
+
+// agrupa os blocos consecutivos da cadeia em pedidos (os buracos não geram
+// pedidos); devolve o número de pedidos
+int xfer_build_runs(int cblock, off_t size, xfer_run *runs) {
+  int n_runs = 0;
+  off_t off = 0;
+
+  while (cblock != -1 && off < size) {
+    if (IS_HOLE_LINK(cblock)) {
+      off += (off_t) HOLE_BLOCKS(cblock) * sb->block_size;
+      cblock = HOLE_NEXT(cblock);
+      continue;
+    }
+    int len = size - off < sb->block_size ? size - off : sb->block_size;
+    if (n_runs > 0 && runs[n_runs-1].buf + runs[n_runs-1].len == BLOCK(cblock)
+	&& runs[n_runs-1].off + runs[n_runs-1].len == off
+	&& runs[n_runs-1].len + len <= XFER_RUN_MAX) {
+      runs[n_runs-1].len += len;
+    } else {
+      runs[n_runs].buf = BLOCK(cblock);
+      runs[n_runs].off = off;
+      runs[n_runs].len = len;
+      n_runs++;
+    }
+    off += len;
+    cblock = fat[cblock];
+  }
+  return n_runs;
+}
+
+
+// alternativa síncrona ao io_uring
+int xfer_sync(int fd, xfer_run *runs, int n_runs, int op) {
+  for (int i = 0; i < n_runs; i++) {
+    char *buf = runs[i].buf;
+    off_t off = runs[i].off;
+    int len = runs[i].len;
+    while (len > 0) {
+      ssize_t n = op == XFER_READ ? pread(fd, buf, len, off) : pwrite(fd, buf, len, off);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
+	return -1;
+      if (n == 0)
+	break;
+      buf += n;
+      off += n;
+      len -= n;
+    }
+  }
+  return 0;
+}
+
+
+int ring_init(io_ring *ring, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return -1;
+  ring->entries = p.sq_entries;
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    ring_exit(ring);
+    return -1;
+  }
+  ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+  return 0;
+}
+
+
+void ring_exit(io_ring *ring) {
+  if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+    munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+    munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  close(ring->fd);
+  return;
+}
+
+
+// marca em lblocks (0 = dados, -1 = buraco) os blocos lógicos do ficheiro UNIX
+// que contêm dados segundo SEEK_DATA/SEEK_HOLE; devolve o número de blocos com dados
+int host_data_map(int fd, off_t size, int *lblocks, int nblocks) {
+  off_t off = 0, data, hole;
+  int n_data = 0, run = 0;
+
+  for (int i = 0; i < nblocks; i++)
+    lblocks[i] = -1;
+  while (off < size) {
+    if ((data = lseek(fd, off, SEEK_DATA)) == -1) {
+      if (errno == ENXIO)
+	break;
+      data = off;  // SEEK_DATA não suportado: tudo são dados
+      hole = size;
+    } else if ((hole = lseek(fd, data, SEEK_HOLE)) == -1 || hole > size)
+      hole = size;
+    for (int i = data / sb->block_size; i <= (hole - 1) / sb->block_size && i < nblocks; i++)
+      lblocks[i] = 0;
+    off = hole;
+  }
+  for (int i = 0; i < nblocks; i++) {
+    // um buraco não pode ultrapassar HOLE_MAX blocos numa só ligação
+    if (lblocks[i] == -1 && ++run > HOLE_MAX)
+      lblocks[i] = 0;
+    if (lblocks[i] == 0) {
+      run = 0;
+      n_data++;
+    }
+  }
+  lseek(fd, 0, SEEK_SET);
+  return n_data;
+}
+
+
+// liga na FAT os blocos lblocks[0..nblocks-1] (-1 = buraco); devolve a primeira ligação
+int link_chain(int *lblocks, int nblocks) {
+  int first = -1, holes = 0;
+  int *link = &first;
+
+  for (int i = 0; i < nblocks; i++) {
+    if (lblocks[i] == -1) {
+      holes++;
+      continue;
+    }
+    *link = holes ? HOLE_LINK(holes, lblocks[i]) : lblocks[i];
+    link = &fat[lblocks[i]];
+    holes = 0;
+  }
+  *link = holes ? HOLE_LINK(holes, -1) : -1;
+  return first;
+}
+
+
+// testa se os len bytes de buf são todos zero (o memcmp da libc é vectorizado)
+int block_is_zero(char *buf, int len) {
+  return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+
 // get fich1 fich2 - copia um ficheiro normal UNIX fich1 para um ficheiro no nosso sistema fich2
 void vfs_get(char *nome_orig, char *nome_dest) {
   int fd;
-  int cblock = current_dir;
-  dir_entry *cur_dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = cur_dir[0].size;
   struct stat buf;
   if ((fd=open(nome_orig,O_RDONLY))==-1){
     printf("NO such File\n");
     return;
   }
-  if (lstat(nome_orig,&buf) < 0) {printf("Error");return;}
-  if(S_ISDIR(buf.st_mode)){printf("target is a directory,chose a file\n");return;}
-  int nblocks = buf.st_size/sb->block_size+1;
-  if(nblocks > sb->n_free_blocks){
+  if (lstat(nome_orig,&buf) < 0) {printf("Error");close(fd);return;}
+  if(S_ISDIR(buf.st_mode)){printf("target is a directory,chose a file\n");close(fd);return;}
+  // o tamanho é guardado num int na entrada do diretório
+  if(buf.st_size > INT_MAX){printf("Way to big\n");close(fd);return;}
+  int nblocks = (buf.st_size + sb->block_size - 1) / sb->block_size;
+  int *lblocks = malloc((nblocks + 1) * sizeof(int));
+  // se o último bloco do diretório está cheio é preciso mais um para a entrada
+  int needed = host_data_map(fd, buf.st_size, lblocks, nblocks);
+  if (((dir_entry *) BLOCK(current_dir))[0].size % DIR_ENTRIES_PER_BLOCK == 0)
+    needed++;
+  if (dir_find(current_dir, nome_dest) != NULL){
+    printf("file with same name exists\n");
+    free(lblocks);
+    close(fd);
+    return;
+  }
+  // só depois de validar: prepare_write copia os diretórios partilhados, o que
+  // também gasta blocos, por isso o espaço é verificado outra vez a seguir
+  int ok = needed <= sb->n_free_blocks;
+  if (!ok)
+    printf("Way to big\n");
+  else if (!(ok = prepare_write()))
+    ;  // prepare_write já escreveu o erro
+  else if (!(ok = needed <= sb->n_free_blocks))
     printf("Way to big\n");
+  if (!ok){
+    free(lblocks);
+    close(fd);
     return;
   }
+  int cblock = current_dir;
+  dir_entry *cur_dir = (dir_entry *) BLOCK(current_dir);
+  int n_entries = cur_dir[0].size;
   while (cblock !=-1){
     int ents = DIR_ENTRIES_PER_BLOCK;
     if(n_entries < DIR_ENTRIES_PER_BLOCK)
@@ -619,6 +1473,8 @@ void vfs_get(char *nome_orig, char *nome_dest) {
     for (int i=0;i<ents;i++){
       if (strcmp(cur_dir[i].name,nome_dest)==0){
 	printf("file with same name exists\n");
+	free(lblocks);
+	close(fd);
 	return;
       }
     }
@@ -634,35 +1490,52 @@ void vfs_get(char *nome_orig, char *nome_dest) {
 	fat[cblock]=freeblock;
 	fat[freeblock]=-1;
 	ents=0;
-	cur_dir = (dir_entry *) BLOCK(current_dir);
-	cur_dir[0].size++;
-	
 	cur_dir = (dir_entry *) BLOCK(freeblock);
 	
       }
-      int  freeblock = sb->free_block;
-      sb->free_block=fat[sb->free_block];
-      fat[freeblock]=-1;
-      sb->n_free_blocks--;
-      init_dir_entry(&cur_dir[ents],TYPE_FILE, nome_dest, 0, freeblock);
+      init_dir_entry(&cur_dir[ents],TYPE_FILE, nome_dest, 0, -1);
       cur_dir[ents].size=buf.st_size;
-      cur_dir = (dir_entry *) BLOCK(current_dir);
-      cur_dir[0].size++;
-      cblock = freeblock;
+      cur_dir = &cur_dir[ents];
+      dir_entry *root = (dir_entry *) BLOCK(current_dir);
+      root[0].size++;
       break;
     }
   }
-  read(fd,BLOCK(cblock),sb->block_size);
-  
-  for (int i=1;i<nblocks;i++){
+  // só os blocos com dados no ficheiro UNIX são reservados
+  for (int i=0;i<nblocks;i++){
+    if (lblocks[i] == -1)
+      continue;
     int freeblock = sb->free_block;
     sb->n_free_blocks--;
     sb->free_block=fat[freeblock];
-    fat[cblock]=freeblock;
-    fat[freeblock]=-1;
-    cblock = freeblock;
-    read(fd,BLOCK(cblock),sb->block_size);
+    lblocks[i] = freeblock;
+  }
+  cur_dir->first_block = link_chain(lblocks, nblocks);
+  if (xfer_blocks(fd, cur_dir->first_block, buf.st_size, XFER_READ) == -1)
+    printf("error reading %s\n", nome_orig);
+
+  // os blocos lidos que ficaram a zero passam a buracos
+  int punched = 0, run = 0;
+  for (int i=0;i<nblocks;i++){
+    if (lblocks[i] == -1) {
+      run++;
+      continue;
+    }
+    int len = i == nblocks - 1 ? buf.st_size - i * sb->block_size : sb->block_size;
+    if (run < HOLE_MAX && block_is_zero(BLOCK(lblocks[i]), len)) {
+      fat[lblocks[i]] = sb->free_block;
+      sb->free_block = lblocks[i];
+      sb->n_free_blocks++;
+      lblocks[i] = -1;
+      punched = 1;
+      run++;
+    } else
+      run = 0;
   }
+  if (punched)
+    cur_dir->first_block = link_chain(lblocks, nblocks);
+  free(lblocks);
+  close(fd);
   return;
 }
 
@@ -685,12 +1558,12 @@ void vfs_put(char *nome_orig, char *nome_dest) {
     n_entries -= DIR_ENTRIES_PER_BLOCK;
     for (int i=0;i<ents;i++){
       if (strcmp(cur_dir[i].name,nome_dest)==0){
-	if(cur_dir[i].type==TYPE_DIR){printf("target is a directory,chose a file\n");return;}
-	int cblock = cur_dir[i].first_block;
-	while (cblock!=-1){
-	  write(fd,BLOCK(cblock),sb->block_size);
-	  cblock = fat[cblock];
-	}
+	if(cur_dir[i].type==TYPE_DIR){printf("target is a directory,chose a file\n");close(fd);return;}
+	// os buracos não são escritos; ftruncate cria os que ficam no fim
+	if (xfer_blocks(fd, cur_dir[i].first_block, cur_dir[i].size, XFER_WRITE) == -1
+	    || ftruncate(fd, cur_dir[i].size) == -1)
+	  printf("error writing %s\n", nome_orig);
+	close(fd);
 	return;
       }
     }
@@ -719,10 +1592,18 @@ void vfs_cat(char *nome_fich) {
       if (strcmp(cur_dir[i].name,nome_fich)==0){
 	if(cur_dir[i].type==TYPE_DIR){printf("target is a directory,chose a file");return;}
 	int cblock = cur_dir[i].first_block;
+	char *zeros = calloc(1, sb->block_size);
 	while (cblock!=-1){
+	  if (IS_HOLE_LINK(cblock)) {
+	    for (int j = 0; j < HOLE_BLOCKS(cblock); j++)
+	      write(STDOUT_FILENO, zeros, sb->block_size);
+	    cblock = HOLE_NEXT(cblock);
+	    continue;
+	  }
 	  write(STDOUT_FILENO, BLOCK(cblock),sb->block_size);
 	  cblock = fat[cblock];
 	}
+	free(zeros);
 	return;
       }
     }
@@ -753,3 +1634,709 @@ void vfs_mv(char *nome_orig, char *nome_dest) {
 void vfs_rm(char *nome_fich) {
   return;
 }
+
+
+// df - escreve a ocupação do sistema de ficheiros (a partir do resumo, se estiver actual)
+void vfs_df(void) {
+  summary_header *h = load_summary();
+  int *extents, n_extents, largest = 0, high_water = FAT_ENTRIES(sb->fat_type);
+
+  if (h != NULL) {
+    extents = (int *) (h + 1);
+    n_extents = h->n_extents;
+    high_water = h->high_water;
+  } else {
+    extents = malloc(FAT_ENTRIES(sb->fat_type) * sizeof(int));
+    n_extents = free_extents(extents);
+    if (n_extents > 0 && extents[2*n_extents-2] + extents[2*n_extents-1] == FAT_ENTRIES(sb->fat_type))
+      high_water = extents[2*n_extents-2];
+  }
+  for (int i = 0; i < n_extents; i++)
+    if (extents[2*i+1] > largest)
+      largest = extents[2*i+1];
+  printf("blocks: %d (%d bytes each)\n", FAT_ENTRIES(sb->fat_type), sb->block_size);
+  printf("free: %d in %d extents (largest %d)\n", sb->n_free_blocks, n_extents, largest);
+  printf("high-water mark: %d\n", high_water);
+  free(h != NULL ? (void *) h : (void *) extents);
+  return;
+}
+
+
+// find [-name GLOB] [-type d|f] [-size [+|-]N] [-date [+|-]AAAA-MM-DD]
+// - escreve os caminhos das entradas abaixo do diretório actual que satisfazem os predicados
+void vfs_find(int argc, char **argv) {
+  walk_ctx ctx;
+  int y, m, d;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.visit = find_visit;
+  for (int i = 0; i < argc; i += 2) {
+    char *val = argv[i+1];
+    int cmp = val[0] == '+' ? 1 : val[0] == '-' ? -1 : 0;
+    if (!strcmp(argv[i], "-name")) {
+      ctx.name = val;
+    } else if (!strcmp(argv[i], "-type")) {
+      if (strcmp(val, "d") && strcmp(val, "f")) {
+	printf("ERROR(input: 'find' - invalid type (%s))\n", val);
+	return;
+      }
+      ctx.type = val[0] == 'd' ? TYPE_DIR : TYPE_FILE;
+    } else if (!strcmp(argv[i], "-size")) {
+      ctx.size_cmp = cmp ? cmp : 2;
+      ctx.size = atoi(cmp ? val + 1 : val);
+    } else if (!strcmp(argv[i], "-date")) {
+      if (sscanf(cmp ? val + 1 : val, "%d-%d-%d", &y, &m, &d) != 3) {
+	printf("ERROR(input: 'find' - invalid date (%s))\n", val);
+	return;
+      }
+      ctx.date_cmp = cmp ? cmp : 2;
+      ctx.date = y * 10000 + m * 100 + d;
+    } else {
+      printf("ERROR(input: 'find' - unknown predicate (%s))\n", argv[i]);
+      return;
+    }
+  }
+  walk_tree(&ctx);
+  return;
+}
+
+
+void find_visit(walk_ctx *ctx, dir_entry *entry, char *path) {
+  int date = (entry->year + 1900) * 10000 + entry->month * 100 + entry->day;
+
+  if (ctx->name != NULL && fnmatch(ctx->name, entry->name, 0) != 0)
+    return;
+  if (ctx->type != 0 && entry->type != ctx->type)
+    return;
+  if (ctx->size_cmp != 0 && (entry->type == TYPE_DIR
+			      || (ctx->size_cmp == 1 && entry->size <= ctx->size)
+			      || (ctx->size_cmp == -1 && entry->size >= ctx->size)
+			      || (ctx->size_cmp == 2 && entry->size != ctx->size)))
+    return;
+  if ((ctx->date_cmp == 1 && date <= ctx->date)
+      || (ctx->date_cmp == -1 && date >= ctx->date)
+      || (ctx->date_cmp == 2 && date != ctx->date))
+    return;
+  walk_report(ctx, path);
+  return;
+}
+
+
+// grep padrão - escreve os caminhos dos ficheiros abaixo do diretório actual que contêm o padrão
+void vfs_grep(char *pattern) {
+  walk_ctx ctx;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.visit = grep_visit;
+  ctx.pattern = pattern;
+  ctx.pattern_len = strlen(pattern);
+  walk_tree(&ctx);
+  return;
+}
+
+
+// procura o padrão directamente nos blocos do ficheiro, agrupados em sequências
+// contíguas; os últimos m-1 bytes já vistos ficam em carry, e as ocorrências que
+// começam neles são procuradas numa janela com carry e o início da sequência seguinte
+void grep_visit(walk_ctx *ctx, dir_entry *entry, char *path) {
+  int m = ctx->pattern_len, n_runs, found = 0, carry_len = 0;
+  off_t end = 0;
+  xfer_run *runs;
+  char *window;
+
+  if (entry->type != TYPE_FILE || entry->size < m)
+    return;
+  runs = malloc(FAT_ENTRIES(sb->fat_type) * sizeof(xfer_run));
+  window = malloc(2 * m);
+  n_runs = xfer_build_runs(entry->first_block, entry->size, runs);
+  for (int i = 0; i < n_runs && !found; i++) {
+    // os buracos são zeros e não podem fazer parte de uma ocorrência
+    if (runs[i].off != end)
+      carry_len = 0;
+    end = runs[i].off + runs[i].len;
+    if (carry_len > 0) {
+      int b = runs[i].len < m - 1 ? runs[i].len : m - 1;
+      memcpy(window + carry_len, runs[i].buf, b);
+      found = search_block(window, carry_len + b, ctx->pattern, m);
+    }
+    if (!found)
+      found = search_block(runs[i].buf, runs[i].len, ctx->pattern, m);
+    // novo carry: os últimos m-1 bytes de carry seguido da sequência
+    if (runs[i].len >= m - 1) {
+      memcpy(window, runs[i].buf + runs[i].len - (m - 1), m - 1);
+      carry_len = m - 1;
+    } else {
+      int keep = carry_len + runs[i].len > m - 1 ? m - 1 - runs[i].len : carry_len;
+      memmove(window, window + carry_len - keep, keep);
+      memcpy(window + keep, runs[i].buf, runs[i].len);
+      carry_len = keep + runs[i].len;
+    }
+  }
+  if (found)
+    walk_report(ctx, path);
+  free(window);
+  free(runs);
+  return;
+}
+
+
+// procura needle em buf; com SSE2 compara o primeiro e o último byte do padrão
+// em 16 posições de cada vez e só confirma com memcmp as posições candidatas
+int search_block(char *buf, int len, char *needle, int m) {
+  if (m == 0)
+    return 1;
+#ifdef __SSE2__
+  if (m > 1) {
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[m-1]);
+    int i;
+    for (i = 0; i + m - 1 + 16 <= len; i += 16) {
+      __m128i bf = _mm_loadu_si128((__m128i *) (buf + i));
+      __m128i bl = _mm_loadu_si128((__m128i *) (buf + i + m - 1));
+      unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+      while (mask != 0) {
+	if (memcmp(buf + i + __builtin_ctz(mask) + 1, needle + 1, m - 2) == 0)
+	  return 1;
+	mask &= mask - 1;
+      }
+    }
+    buf += i;
+    len -= i;
+  }
+#endif
+  return memmem(buf, len, needle, m) != NULL;
+}
+
+
+// percorre em paralelo a árvore abaixo do diretório actual, chamando ctx->visit
+// para cada entrada; cada thread tem a sua fila de diretórios e, quando a esvazia,
+// rouba trabalho às filas das outras
+void walk_tree(walk_ctx *ctx) {
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t threads[MAX_WALK_THREADS];
+  walk_worker workers[MAX_WALK_THREADS];
+  walk_task root;
+
+  ctx->n_workers = n_cpus < 1 ? 1 : n_cpus > MAX_WALK_THREADS ? MAX_WALK_THREADS : n_cpus;
+  ctx->queues = calloc(ctx->n_workers, sizeof(walk_queue));
+  for (int i = 0; i < ctx->n_workers; i++)
+    pthread_mutex_init(&ctx->queues[i].lock, NULL);
+  pthread_mutex_init(&ctx->lock, NULL);
+  root.block = current_dir;
+  root.path = strdup(".");
+  walk_push(ctx, 0, root);
+
+  int started = 0;
+  for (int i = 0; i < ctx->n_workers; i++) {
+    workers[i].ctx = ctx;
+    workers[i].id = i;
+    if (pthread_create(&threads[i], NULL, walk_thread, &workers[i]) != 0)
+      break;
+    started++;
+  }
+  // as threads que arrancaram roubam as tarefas de todas as filas; sem nenhuma,
+  // a travessia é feita nesta thread
+  if (started == 0)
+    walk_thread(&workers[0]);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  qsort(ctx->results, ctx->n_results, sizeof(char *), cmp_path);
+  for (int i = 0; i < ctx->n_results; i++) {
+    printf("%s\n", ctx->results[i]);
+    free(ctx->results[i]);
+  }
+  free(ctx->results);
+  for (int i = 0; i < ctx->n_workers; i++) {
+    pthread_mutex_destroy(&ctx->queues[i].lock);
+    free(ctx->queues[i].tasks);
+  }
+  free(ctx->queues);
+  pthread_mutex_destroy(&ctx->lock);
+  return;
+}
+
+
+void *walk_thread(void *arg) {
+  walk_ctx *ctx = ((walk_worker *) arg)->ctx;
+  int id = ((walk_worker *) arg)->id;
+  walk_task task;
+
+  while (1) {
+    if (!walk_pop(ctx, id, &task)) {
+      if (__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) == 0)
+	break;
+      sched_yield();
+      continue;
+    }
+    int cblock = task.block;
+    dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+    int n_entries = cur_dir[0].size;
+    while (cblock != -1) {
+      int ents = DIR_ENTRIES_PER_BLOCK;
+      if (n_entries < DIR_ENTRIES_PER_BLOCK)
+	ents = n_entries;
+      n_entries -= DIR_ENTRIES_PER_BLOCK;
+      for (int i = 0; i < ents; i++) {
+	if (!strcmp(cur_dir[i].name, ".") || !strcmp(cur_dir[i].name, ".."))
+	  continue;
+	char *path = malloc(strlen(task.path) + strlen(cur_dir[i].name) + 2);
+	sprintf(path, "%s/%s", task.path, cur_dir[i].name);
+	ctx->visit(ctx, &cur_dir[i], path);
+	if (cur_dir[i].type == TYPE_DIR) {
+	  walk_task sub = { cur_dir[i].first_block, path };
+	  walk_push(ctx, id, sub);
+	} else
+	  free(path);
+      }
+      cblock = fat[cblock];
+      cur_dir = (dir_entry *) BLOCK(cblock);
+    }
+    free(task.path);
+    __atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+
+void walk_push(walk_ctx *ctx, int id, walk_task task) {
+  walk_queue *q = &ctx->queues[id];
+
+  __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->cap) {
+    // compacta a fila ou aumenta-a
+    if (q->head > 0) {
+      memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(walk_task));
+      q->tail -= q->head;
+      q->head = 0;
+    } else {
+      q->cap = q->cap ? 2 * q->cap : 64;
+      q->tasks = realloc(q->tasks, q->cap * sizeof(walk_task));
+    }
+  }
+  q->tasks[q->tail++] = task;
+  pthread_mutex_unlock(&q->lock);
+  return;
+}
+
+
+// tira uma tarefa da própria fila ou, se estiver vazia, rouba uma a outra thread
+int walk_pop(walk_ctx *ctx, int id, walk_task *task) {
+  walk_queue *q = &ctx->queues[id];
+
+  pthread_mutex_lock(&q->lock);
+  if (q->tail > q->head) {
+    *task = q->tasks[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  for (int i = 1; i < ctx->n_workers; i++) {
+    q = &ctx->queues[(id + i) % ctx->n_workers];
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+      *task = q->tasks[q->head++];
+      pthread_mutex_unlock(&q->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return 0;
+}
+
+
+void walk_report(walk_ctx *ctx, char *path) {
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->n_results == ctx->results_cap) {
+    ctx->results_cap = ctx->results_cap ? 2 * ctx->results_cap : 64;
+    ctx->results = realloc(ctx->results, ctx->results_cap * sizeof(char *));
+  }
+  ctx->results[ctx->n_results++] = strdup(path);
+  pthread_mutex_unlock(&ctx->lock);
+  return;
+}
+
+
+//used to sort the paths found by find and grep
+int cmp_path(const void * a, const void * b){
+  return (strcmp(*(char **) a, *(char **) b));
+}
+
+
+// snapshots
+//
+// Um snapshot é uma cópia do bloco do diretório raiz guardada no diretório de
+// snapshots (sb->snap_block). Tudo o resto é partilhado com a árvore activa:
+// a tabela sb->ref_block guarda, para o 1º bloco de cada cadeia, quantas
+// referências tem além da primeira. Antes de alterar um diretório partilhado,
+// prepare_write copia-o (e os diretórios acima dele) e passa a partilha para
+// as cadeias que ele referencia, de modo que o custo é proporcional aos
+// diretórios alterados depois do snapshot e não ao tamanho do volume.
+
+// snapshot nome - cria um snapshot só de leitura de todo o sistema de ficheiros
+void vfs_snapshot(char *name) {
+  dir_entry *entry, *snaps;
+  int ref_blocks = (FAT_ENTRIES(sb->fat_type) + sb->block_size - 1) / sb->block_size;
+
+  if (mounted_snapshot != NULL) {
+    printf("snapshot is read-only\n");
+    return;
+  }
+  if (strlen(name) > MAX_NAME_LENGHT || name[0] == '-' || !strcmp(name, ".") || !strcmp(name, "..")) {
+    printf("invalid snapshot name\n");
+    return;
+  }
+  if (snapshot_find(name) != NULL) {
+    printf("snapshot with same name exists\n");
+    return;
+  }
+  if (sb->snap_block != 0 && ((dir_entry *) BLOCK(sb->snap_block))[0].size - 2 >= MAX_SNAPSHOTS) {
+    printf("too many snapshots\n");
+    return;
+  }
+  release_summary();
+  // reserva para o pior caso: tabela, diretório de snapshots, nova entrada e cópia da raiz
+  int root_blocks = 0;
+  for (int cblock = sb->root_block; cblock != -1; cblock = fat[cblock])
+    root_blocks++;
+  if (ref_blocks + 2 + root_blocks > sb->n_free_blocks) {
+    printf("filesystem full\n");
+    return;
+  }
+  if (sb->ref_block == 0) {
+    int prev = -1;
+    for (int i = 0; i < ref_blocks; i++) {
+      int freeblock = sb->free_block;
+      sb->n_free_blocks--;
+      sb->free_block = fat[freeblock];
+      fat[freeblock] = -1;
+      memset(BLOCK(freeblock), 0, sb->block_size);
+      if (prev == -1)
+	sb->ref_block = freeblock;
+      else
+	fat[prev] = freeblock;
+      prev = freeblock;
+    }
+  }
+  if (sb->snap_block == 0) {
+    int freeblock = sb->free_block;
+    sb->n_free_blocks--;
+    sb->free_block = fat[freeblock];
+    fat[freeblock] = -1;
+    init_dir_block(freeblock, freeblock);
+    sb->snap_block = freeblock;
+  }
+  int root = dir_copy(sb->root_block, -1);
+  entry = dir_append(sb->snap_block);
+  init_dir_entry(entry, TYPE_DIR, name, 0, root);
+  snaps = (dir_entry *) BLOCK(sb->snap_block);
+  snaps[0].size++;
+  return;
+}
+
+
+// snapshot -d nome - apaga o snapshot e liberta de uma só vez os blocos que só ele usava
+void vfs_snapshot_delete(char *name) {
+  dir_entry *entry;
+  int head = -1, tail = -1, n = 0;
+
+  if ((entry = snapshot_find(name)) == NULL) {
+    printf("no such snapshot\n");
+    return;
+  }
+  if (mounted_snapshot != NULL && !strcmp(mounted_snapshot, name)) {
+    printf("snapshot is mounted\n");
+    return;
+  }
+  release_summary();
+  tree_release(entry->first_block, TYPE_DIR, &head, &tail, &n);
+  if (n > 0) {
+    fat[tail] = sb->free_block;
+    sb->free_block = head;
+    sb->n_free_blocks += n;
+  }
+  dir_remove(sb->snap_block, entry);
+  return;
+}
+
+
+// snapshot - lista os snapshots existentes
+void vfs_snapshot_list(void) {
+  if (sb->snap_block == 0)
+    return;
+  int cblock = sb->snap_block;
+  dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+  int n_entries = cur_dir[0].size;
+  while (cblock != -1) {
+    int ents = DIR_ENTRIES_PER_BLOCK;
+    if (n_entries < DIR_ENTRIES_PER_BLOCK)
+      ents = n_entries;
+    n_entries -= DIR_ENTRIES_PER_BLOCK;
+    for (int i = 0; i < ents; i++)
+      if (strcmp(cur_dir[i].name, ".") && strcmp(cur_dir[i].name, ".."))
+	printf("%s \t%d-%d-%d\n", cur_dir[i].name, cur_dir[i].day, cur_dir[i].month, cur_dir[i].year+1900);
+    cblock = fat[cblock];
+    cur_dir = (dir_entry *) BLOCK(cblock);
+  }
+  return;
+}
+
+
+// mount nome - passa a usar (só para leitura) a árvore do snapshot
+void vfs_mount(char *name) {
+  dir_entry *entry;
+
+  if ((entry = snapshot_find(name)) == NULL) {
+    printf("no such snapshot\n");
+    return;
+  }
+  free(mounted_snapshot);
+  mounted_snapshot = strdup(entry->name);
+  current_dir = entry->first_block;
+  dir_path[0] = current_dir;
+  dir_depth = 0;
+  return;
+}
+
+
+// umount - volta à raiz da árvore activa
+void vfs_umount(void) {
+  free(mounted_snapshot);
+  mounted_snapshot = NULL;
+  current_dir = sb->root_block;
+  dir_path[0] = current_dir;
+  dir_depth = 0;
+  return;
+}
+
+
+dir_entry *snapshot_find(char *name) {
+  if (sb->snap_block == 0)
+    return NULL;
+  int cblock = sb->snap_block;
+  dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+  int n_entries = cur_dir[0].size;
+  while (cblock != -1) {
+    int ents = DIR_ENTRIES_PER_BLOCK;
+    if (n_entries < DIR_ENTRIES_PER_BLOCK)
+      ents = n_entries;
+    n_entries -= DIR_ENTRIES_PER_BLOCK;
+    for (int i = 0; i < ents; i++)
+      if (!strcmp(cur_dir[i].name, name) && strcmp(name, ".") && strcmp(name, ".."))
+	return &cur_dir[i];
+    cblock = fat[cblock];
+    cur_dir = (dir_entry *) BLOCK(cblock);
+  }
+  return NULL;
+}
+
+
+// procura a entrada com o nome dado no diretório que começa no bloco
+dir_entry *dir_find(int cblock, char *name) {
+  dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+  int n_entries = cur_dir[0].size;
+  while (cblock != -1) {
+    int ents = DIR_ENTRIES_PER_BLOCK;
+    if (n_entries < DIR_ENTRIES_PER_BLOCK)
+      ents = n_entries;
+    n_entries -= DIR_ENTRIES_PER_BLOCK;
+    for (int i = 0; i < ents; i++)
+      if (!strcmp(cur_dir[i].name, name))
+	return &cur_dir[i];
+    cblock = fat[cblock];
+    cur_dir = (dir_entry *) BLOCK(cblock);
+  }
+  return NULL;
+}
+
+
+// contagem de referências partilhadas da cadeia que começa no bloco
+unsigned char *block_ref(int block) {
+  int cblock = sb->ref_block;
+  for (int i = block / sb->block_size; i > 0; i--)
+    cblock = fat[cblock];
+  return (unsigned char *) BLOCK(cblock) + block % sb->block_size;
+}
+
+
+// 1º bloco com dados de uma cadeia (salta um buraco inicial) ou -1
+int chain_head(int link) {
+  return IS_HOLE_LINK(link) ? HOLE_NEXT(link) : link;
+}
+
+
+// garante que os diretórios desde a raiz até ao corrente não são partilhados com
+// nenhum snapshot, copiando-os se necessário; devolve 0 se não se pode escrever
+int prepare_write(void) {
+  if (mounted_snapshot != NULL) {
+    printf("snapshot is read-only\n");
+    return 0;
+  }
+  release_summary();
+  if (sb->ref_block == 0)
+    return 1;
+  for (int d = 1; d <= dir_depth; d++) {
+    if (*block_ref(dir_path[d]) == 0)
+      continue;
+    int copy = dir_copy(dir_path[d], dir_path[d-1]);
+    if (copy == -1) {
+      printf("filesystem full\n");
+      return 0;
+    }
+    (*block_ref(dir_path[d]))--;
+    // o pai já não é partilhado: actualiza a entrada que apontava para o original
+    int cblock = dir_path[d-1];
+    dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+    int n_entries = cur_dir[0].size;
+    while (cblock != -1) {
+      int ents = DIR_ENTRIES_PER_BLOCK;
+      if (n_entries < DIR_ENTRIES_PER_BLOCK)
+	ents = n_entries;
+      n_entries -= DIR_ENTRIES_PER_BLOCK;
+      for (int i = 0; i < ents; i++)
+	if (cur_dir[i].first_block == dir_path[d] && cur_dir[i].type == TYPE_DIR
+	    && strcmp(cur_dir[i].name, ".") && strcmp(cur_dir[i].name, ".."))
+	  cur_dir[i].first_block = copy;
+      cblock = fat[cblock];
+      cur_dir = (dir_entry *) BLOCK(cblock);
+    }
+    dir_path[d] = copy;
+  }
+  current_dir = dir_path[dir_depth];
+  return 1;
+}
+
+
+// copia a cadeia de um diretório; as cadeias que ele referencia passam a ter mais
+// uma referência. Devolve o 1º bloco da cópia ou -1 se não há espaço
+int dir_copy(int block, int parent_block) {
+  int n = 0, first = -1, prev = -1;
+
+  for (int cblock = block; cblock != -1; cblock = fat[cblock])
+    n++;
+  if (n > sb->n_free_blocks)
+    return -1;
+  for (int cblock = block; cblock != -1; cblock = fat[cblock]) {
+    int freeblock = sb->free_block;
+    sb->n_free_blocks--;
+    sb->free_block = fat[freeblock];
+    fat[freeblock] = -1;
+    memcpy(BLOCK(freeblock), BLOCK(cblock), sb->block_size);
+    if (prev == -1)
+      first = freeblock;
+    else
+      fat[prev] = freeblock;
+    prev = freeblock;
+  }
+  dir_entry *dir = (dir_entry *) BLOCK(first);
+  dir[0].first_block = first;
+  dir[1].first_block = parent_block == -1 ? first : parent_block;
+
+  int cblock = first;
+  dir_entry *cur_dir = dir;
+  int n_entries = dir[0].size;
+  while (cblock != -1) {
+    int ents = DIR_ENTRIES_PER_BLOCK;
+    if (n_entries < DIR_ENTRIES_PER_BLOCK)
+      ents = n_entries;
+    n_entries -= DIR_ENTRIES_PER_BLOCK;
+    for (int i = 0; i < ents; i++) {
+      int head = chain_head(cur_dir[i].first_block);
+      if (head >= 0 && strcmp(cur_dir[i].name, ".") && strcmp(cur_dir[i].name, ".."))
+	(*block_ref(head))++;
+    }
+    cblock = fat[cblock];
+    cur_dir = (dir_entry *) BLOCK(cblock);
+  }
+  return first;
+}
+
+
+// larga uma referência para a cadeia; se era a última, larga também as cadeias
+// que ela referencia e junta os blocos à lista head..tail (n blocos)
+void tree_release(int link, char type, int *head, int *tail, int *n) {
+  int first = chain_head(link);
+
+  if (first < 0)
+    return;
+  if (*block_ref(first) > 0) {
+    (*block_ref(first))--;
+    return;
+  }
+  if (type == TYPE_DIR) {
+    int cblock = first;
+    dir_entry *cur_dir = (dir_entry *) BLOCK(cblock);
+    int n_entries = cur_dir[0].size;
+    while (cblock != -1) {
+      int ents = DIR_ENTRIES_PER_BLOCK;
+      if (n_entries < DIR_ENTRIES_PER_BLOCK)
+	ents = n_entries;
+      n_entries -= DIR_ENTRIES_PER_BLOCK;
+      for (int i = 0; i < ents; i++)
+	if (strcmp(cur_dir[i].name, ".") && strcmp(cur_dir[i].name, ".."))
+	  tree_release(cur_dir[i].first_block, cur_dir[i].type, head, tail, n);
+      cblock = fat[cblock];
+      cur_dir = (dir_entry *) BLOCK(cblock);
+    }
+  }
+  int cblock = first;
+  while (cblock != -1) {
+    if (IS_HOLE_LINK(cblock)) {
+      cblock = HOLE_NEXT(cblock);
+      continue;
+    }
+    int next = fat[cblock];
+    fat[cblock] = *head;
+    *head = cblock;
+    if (*tail == -1)
+      *tail = cblock;
+    (*n)++;
+    cblock = next;
+  }
+  return;
+}
+
+
+// devolve o lugar da próxima entrada do diretório, acrescentando-lhe um bloco se
+// estiver cheio (o chamador incrementa o número de entradas)
+dir_entry *dir_append(int block) {
+  dir_entry *dir = (dir_entry *) BLOCK(block);
+  int n = dir[0].size, cblock = block;
+
+  while (n >= DIR_ENTRIES_PER_BLOCK && fat[cblock] != -1) {
+    cblock = fat[cblock];
+    n -= DIR_ENTRIES_PER_BLOCK;
+  }
+  if (n == DIR_ENTRIES_PER_BLOCK) {
+    int freeblock = sb->free_block;
+    sb->n_free_blocks--;
+    sb->free_block = fat[freeblock];
+    fat[freeblock] = -1;
+    fat[cblock] = freeblock;
+    return (dir_entry *) BLOCK(freeblock);
+  }
+  return (dir_entry *) BLOCK(cblock) + n;
+}
+
+
+// remove a entrada do diretório, pondo no seu lugar a última
+void dir_remove(int block, dir_entry *entry) {
+  dir_entry *dir = (dir_entry *) BLOCK(block);
+  int last = (dir[0].size - 1) % DIR_ENTRIES_PER_BLOCK;
+  int cblock = block, prev = -1;
+
+  while (fat[cblock] != -1) {
+    prev = cblock;
+    cblock = fat[cblock];
+  }
+  *entry = ((dir_entry *) BLOCK(cblock))[last];
+  dir[0].size--;
+  if (last == 0 && prev != -1) {
+    fat[prev] = -1;
+    fat[cblock] = sb->free_block;
+    sb->free_block = cblock;
+    sb->n_free_blocks++;
+  }
+  return;
+}